@@ -3,18 +3,60 @@
  * learned from looking at usbmon/wireshark.
  *
  * Linux:
- *   gcc -o zwoeaf-set zwoeaf-set.c -lhidapi-libusb -Wall -Werror
+ *   gcc -o zwoeaf-set zwoeaf-set.c -lhidapi-libusb -lm -Wall -Werror
  * OS X hidapi built from source:
- *   gcc -o zwoeaf-set zwoeaf-set.c -L/.../hidapi/build/src/mac -lhidapi -Wall -Werror
+ *   gcc -o zwoeaf-set zwoeaf-set.c -L/.../hidapi/build/src/mac -lhidapi -lm -Wall -Werror
  * OS X hidapi from homebrew:
- *   gcc -o zwoeaf-set zwoeaf-set.c -lhidapi -Wall -Werror
+ *   gcc -o zwoeaf-set zwoeaf-set.c -lhidapi -lm -Wall -Werror
  *
  * Run:
  *   ./zwoeaf-set [<abs pos>|<[-+]rel pos]; echo $?
  * Prints current+max position if no arg given. If movement requested, will
  * continue printing current+target position until exit; if $?=0 current and
  * target should be same. Use last row of output to get current position
- * regardless. May need sudo on Linux.
+ * regardless. May need sudo on Linux. After a move, stderr ends with a
+ * breakdown of where the time went (see latency_report()).
+ *
+ * Where each move ends up is also saved under $ZWO_STATE_DIR (~/.zwo by
+ * default) for that focuser. If the focuser comes up somewhere else, e.g.
+ * after losing power, that's reported on stderr along with the saved value,
+ * which is kept, and the difference is recorded as a sync that's needed (see
+ * eaf_check_position()). Until then positions given and printed are the
+ * saved ones, i.e. the difference is applied to every move, and focus-save
+ * refuses to record anything.
+ * TODO: once the firmware's "set current position" command turns up in a
+ * capture, use it there to put the saved position back and drop the sync.
+ *
+ *   ./zwoeaf-set selftest; echo $?
+ * Finds every EAF and, on all of them at once, reads position, moves out by
+ * SELFTEST_STEPS and back again. Prints one line per focuser with timings;
+ * exits nonzero if any focuser failed.
+ *
+ *   ./zwoeaf-set status [<max age ms>]; echo $?
+ * One line per focuser with its position and how old that is. The saved
+ * position above is used if it's no older than max age (default
+ * STATUS_MAX_AGE_MS); the rest of the focusers are asked all at once, one
+ * process each. A focuser another run is busy with is reported from the
+ * saved position whatever its age.
+ *
+ *   ./zwoeaf-set fit <journal>; echo $?
+ * Reads a ZWO_JOURNAL file (see journal_report()) and writes a profile of
+ * each focuser in it to eaf-<serial>.twin in the state directory: how long
+ * moves took to start and finish, speed while moving in each FIT_BUCKET
+ * wide stretch of travel, and how often reports looked odd or never came
+ * back. Something pretending to be that focuser can be driven from it.
+ * Prints the same on stdout.
+ *
+ *   ./zwoeaf-set focus-save <train> <slot> <temp>; echo $?
+ *   ./zwoeaf-set focus-predict <train> <slot> <temp>; echo $?
+ * Keeps a history of best focus positions for autofocus to start from.
+ * focus-save records the focuser's current position as best focus for the
+ * named optical train, filter slot and temperature (in C, from wherever you
+ * get it; the EAF's own sensor isn't decoded here). focus-predict doesn't
+ * touch the focuser, it prints "<position> <uncertainty>" as the last line,
+ * fitted from that train's history, or exits nonzero if there's none for that
+ * slot. Uncertainty is how far best focus is likely to be from that (one
+ * standard error), or -1 if there isn't enough history to tell.
  *
  * Only tested with my one "new" 5V device.
  *
@@ -61,6 +103,12 @@
 #include <wchar.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <hidapi/hidapi.h>
 
@@ -70,6 +118,21 @@
 /* for requesting feature reports, add one to this and include report ID */
 #define ZWO_REPORT_LEN 16
 
+/* how many focusers selftest and status will look at */
+#define MAX_DEVICES 16
+
+/* how stale a saved position status will report by default */
+#define STATUS_MAX_AGE_MS 1000
+
+/* longest a camera transfer can hold polling off for, see poll_wait() */
+#define BULK_DEFER_MAX_MS 10000
+
+/* how far selftest moves them */
+#define SELFTEST_STEPS 100
+
+/* width in steps of the position ranges fit gives speeds for */
+#define FIT_BUCKET 4096
+
 /*
  init:  pos 25000 (0x61a8)
   out  037e5a02030000000000000000000000
@@ -101,6 +164,475 @@
    in  017e5a03000000006590007fd232ea60   # 26000=0x6590
  */
 
+/*
+ * If ZWO_JOURNAL is set in the environment, every report sent to or received
+ * from the device is appended there, one per line, as
+ *   <epoch secs.usecs> eaf <serial> out|in <hex bytes>
+ * so move timing and status sequences can be studied later (or replayed into
+ * something pretending to be this particular device). Both programs can share
+ * the same file.
+ */
+static FILE *journal = NULL;
+
+/* filled in by device_opened(), names per-device state files too */
+static char device_serial[64] = "-";
+
+/* position reports are printed unless this is cleared (selftest does) */
+static bool verbose = true;
+
+long long
+now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* for timestamps that mean something to other processes */
+long long
+epoch_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long
+now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Per-device state lives in $ZWO_STATE_DIR, or ~/.zwo if that isn't set.
+ * Fills in the path to the named file, creating the directory if needed.
+ */
+int
+state_path(char *path, size_t len, const char *name) {
+  char dirbuf[256];
+  const char *dir = getenv("ZWO_STATE_DIR");
+  if (!dir || !*dir) {
+    const char *home = getenv("HOME");
+    if (!home)
+      return -1;
+    snprintf(dirbuf, sizeof(dirbuf), "%s/.zwo", home);
+    dir = dirbuf;
+  }
+  mkdir(dir, 0755); /* fine if it's already there */
+  if (snprintf(path, len, "%s/%s", dir, name) >= (int)len)
+    return -1;
+  return 0;
+}
+
+/*
+ * The saved position file holds "<position> <epoch ms>". It's written to
+ * a temporary and renamed over so a power cut never leaves half a file.
+ */
+int
+eaf_save_position(uint16_t pos) {
+  char path[512], tmppath[520], name[128];
+
+  snprintf(name, sizeof(name), "eaf-%s.pos", device_serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+  FILE *f = fopen(tmppath, "w");
+  if (!f)
+    return -1;
+  fprintf(f, "%d %lld\n", pos, epoch_ms());
+  if ( (fflush(f) != 0) || (fsync(fileno(f)) != 0) ) {
+    fclose(f);
+    return -1;
+  }
+  if (fclose(f) != 0)
+    return -1;
+  return rename(tmppath, path);
+}
+
+int
+eaf_load_position(const char *serial, uint16_t *posret, long long *whenret) {
+  char path[512], name[128];
+  long long when;
+  int pos;
+
+  snprintf(name, sizeof(name), "eaf-%s.pos", serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  int n = fscanf(f, "%d %lld", &pos, &when);
+  fclose(f);
+  if ( (n != 2) || (pos < 0) || (pos > 0xffff) )
+    return -1;
+  *posret = pos;
+  if (whenret)
+    *whenret = when;
+  return 0;
+}
+
+/*
+ * The focuser came up reporting somewhere other than the saved position,
+ * so the two disagree by an offset (saved - reported) until it's synced.
+ * Kept in eaf-<serial>.sync as "<offset> <epoch ms>".
+ */
+int
+eaf_save_sync(int offset) {
+  char path[512], name[128];
+
+  snprintf(name, sizeof(name), "eaf-%s.sync", device_serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return -1;
+  fprintf(f, "%d %lld\n", offset, epoch_ms());
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+/* returns 0 with the offset if a sync is needed */
+int
+eaf_load_sync(const char *serial, int *offsetret) {
+  char path[512], name[128];
+  long long when;
+  int offset;
+
+  snprintf(name, sizeof(name), "eaf-%s.sync", serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  int n = fscanf(f, "%d %lld", &offset, &when);
+  fclose(f);
+  if (n != 2)
+    return -1;
+  if (offsetret)
+    *offsetret = offset;
+  return 0;
+}
+
+bool
+eaf_sync_needed(const char *serial) {
+  return eaf_load_sync(serial, NULL) == 0;
+}
+
+/*
+ * Check a position just read from the focuser, before moving it, against the
+ * saved one, allowing for any sync that's already needed. If they agree, or
+ * nothing's saved yet, the saved position is refreshed. Otherwise the saved
+ * position is left as it is, the new offset is recorded, and 1 is returned
+ * with the saved position in *savedret. Either way *offsetret gets the offset
+ * to add to what the focuser says.
+ */
+int
+eaf_check_position(uint16_t pos, uint16_t *savedret, int *offsetret) {
+  uint16_t savedpos;
+  int offset = 0;
+
+  eaf_load_sync(device_serial, &offset);
+  if ( (eaf_load_position(device_serial, &savedpos, NULL) == 0) &&
+       (savedpos != pos + offset) ) {
+    offset = savedpos - pos;
+    eaf_save_sync(offset);
+    if (savedret)
+      *savedret = savedpos;
+    if (offsetret)
+      *offsetret = offset;
+    return 1;
+  }
+  if (offsetret)
+    *offsetret = offset;
+  eaf_save_position(pos + offset);
+  return 0;
+}
+
+/*
+ * Best focus history, one "<train> <slot> <temp> <position>" per line in the
+ * state directory. The same for all focusers; the train name says which.
+ */
+int
+eaf_focus_save(const char *train, int slot, double temp, uint16_t pos) {
+  char path[512];
+
+  if (state_path(path, sizeof(path), "eaf-focus") != 0)
+    return -1;
+  FILE *f = fopen(path, "a");
+  if (!f)
+    return -1;
+  fprintf(f, "%s %d %.2f %d\n", train, slot, temp, pos);
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Fits position = offset[slot] + slope * temp over the whole train's history,
+ * i.e. one thermal slope for the train and a fixed offset per filter, so a
+ * slot with a single entry still gets the benefit of the others. Uncertainty
+ * is the standard error of a new best focus position at that temperature,
+ * i.e. the scatter of the history about the fit plus how well the fit itself
+ * is pinned down there, so it never goes below the scatter however much
+ * history there is.
+ */
+int
+eaf_focus_predict(const char *train, int slot, double temp) {
+  char path[512], line[512], ftrain[128];
+  int fslot, fpos;
+  double ftemp;
+  /* per-slot sums; slots are 1..7 but allow some room */
+  int n[16] = { 0 };
+  double st[16] = { 0 }, sp[16] = { 0 }, stt[16] = { 0 }, stp[16] = { 0 };
+  double spp[16] = { 0 };
+  int i;
+
+  if ( (slot < 0) || (slot >= 16) )
+    return -1;
+  if (state_path(path, sizeof(path), "eaf-focus") != 0)
+    return -1;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    /* skip anything mangled rather than lose the rest of the history */
+    if (sscanf(line, "%127s %d %lf %d", ftrain, &fslot, &ftemp, &fpos) != 4)
+      continue;
+    if ( (strcmp(ftrain, train) != 0) || (fslot < 0) || (fslot >= 16) )
+      continue;
+    n[fslot]++;
+    st[fslot] += ftemp;
+    sp[fslot] += fpos;
+    stt[fslot] += ftemp * ftemp;
+    stp[fslot] += ftemp * fpos;
+    spp[fslot] += (double)fpos * fpos;
+  }
+  fclose(f);
+  if (n[slot] == 0)
+    return -1;
+
+  /* pooled within-slot sums of squares */
+  double sxx = 0, sxy = 0, syy = 0;
+  int total = 0, groups = 0;
+  for (i = 0; i < 16; i++) {
+    if (n[i] == 0)
+      continue;
+    sxx += stt[i] - st[i] * st[i] / n[i];
+    sxy += stp[i] - st[i] * sp[i] / n[i];
+    syy += spp[i] - sp[i] * sp[i] / n[i];
+    total += n[i];
+    groups++;
+  }
+  double slope = (sxx > 1e-9) ? sxy / sxx : 0;
+  double tmean = st[slot] / n[slot];
+  double pred = sp[slot] / n[slot] + slope * (temp - tmean);
+  if (pred < 0)
+    pred = 0;
+  if (pred > 0xffff)
+    pred = 0xffff;
+
+  double uncertainty = -1;
+  int dof = total - groups - (sxx > 1e-9 ? 1 : 0);
+  if (dof > 0) {
+    double resid = syy - slope * sxy;
+    double sigma = sqrt((resid > 0 ? resid : 0) / dof);
+    double se = 1 + 1.0 / n[slot];
+    if (sxx > 1e-9)
+      se += (temp - tmean) * (temp - tmean) / sxx;
+    uncertainty = sigma * sqrt(se);
+  }
+  fprintf(stderr, "%s slot %d: %d of %d entries, slope %.1f/C\n",
+          train, slot, n[slot], total, slope);
+  printf("%.0f %.0f\n", pred, uncertainty);
+  return 0;
+}
+
+/*
+ * Where the time went, printed on stderr after a move by latency_report().
+ * The move is split up by the position reports seen after the command:
+ * "command" until the first one showing it moving, "moving" until the last
+ * one showing it moving, and "last poll" from there to the one showing it
+ * arrived. It got there somewhere in that last bit, so on average half of it
+ * is lost to the poll interval.
+ */
+static struct {
+  long long start, opened, ready;             /* startup milestones */
+  long long cmd, first_moving, last_moving;   /* current move */
+  long long command_us, moving_us, lastpoll_us;
+  long long usb_us, sleep_us;
+  int usb_count, moves;
+} lat;
+
+void
+latency_command(void) {
+  lat.cmd = now_us();
+  lat.first_moving = lat.last_moving = 0;
+}
+
+/* after every position report */
+void
+latency_position(bool moving) {
+  if (!lat.cmd || !moving)
+    return;
+  lat.last_moving = now_us();
+  if (!lat.first_moving)
+    lat.first_moving = lat.last_moving;
+}
+
+/* once the caller's happy the move is done */
+void
+latency_arrived(void) {
+  if (!lat.cmd)
+    return;
+  long long now = now_us();
+  long long first = lat.first_moving ? lat.first_moving : now;
+  long long last = lat.last_moving ? lat.last_moving : now;
+  lat.command_us += first - lat.cmd;
+  lat.moving_us += last - first;
+  lat.lastpoll_us += now - last;
+  lat.moves++;
+  lat.cmd = 0;
+}
+
+/* after each exchange with the focuser, t0 being when it started */
+void
+latency_usb(long long t0) {
+  lat.usb_us += now_us() - t0;
+  lat.usb_count++;
+}
+
+void
+latency_report(void) {
+  if (!lat.moves)
+    return;
+  long long moves_us = lat.command_us + lat.moving_us + lat.lastpoll_us;
+  fprintf(stderr, "latency: total %lldms, startup %lldms (open %lldms, "
+          "ready %lldms), move %lldms\n",
+          (now_us() - lat.start) / 1000, (lat.ready - lat.start) / 1000,
+          (lat.opened - lat.start) / 1000, (lat.ready - lat.opened) / 1000,
+          moves_us / 1000);
+  fprintf(stderr, "latency: move: command %lldms, moving %lldms, "
+          "last poll %lldms (about half lost to 500ms polling)\n",
+          lat.command_us / 1000, lat.moving_us / 1000,
+          lat.lastpoll_us / 1000);
+  fprintf(stderr, "latency: %d usb exchange(s) %.1fms, "
+          "%lldms asleep between polls\n",
+          lat.usb_count, lat.usb_us / 1000.0, lat.sleep_us / 1000);
+}
+
+/*
+ * Capture software can send SIGUSR1 while it's pulling a frame off a camera
+ * on the same USB controller, and SIGUSR2 when it's done, e.g.
+ *   pkill -USR1 -x 'zwoefw-set|zwoeaf-set'; <download>;
+ *   pkill -USR2 -x 'zwoefw-set|zwoeaf-set'
+ * Match the names exactly: anything else that gets these signals without a
+ * handler for them is killed by them.
+ * Polls due in between are held off until SIGUSR2 (or BULK_DEFER_MAX_MS)
+ * and then done straight away. How much that delayed things is printed on
+ * stderr at exit.
+ */
+static volatile sig_atomic_t bulk_active = 0;
+static int bulk_deferrals = 0;
+static long long bulk_deferred_ms = 0;
+
+void
+bulk_signal(int sig) {
+  bulk_active = (sig == SIGUSR1);
+}
+
+void
+bulk_setup(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = bulk_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+void
+bulk_report(void) {
+  if (bulk_deferrals)
+    fprintf(stderr, "held off %d poll(s) for %lldms during camera transfers\n",
+            bulk_deferrals, bulk_deferred_ms);
+}
+
+/* use instead of usleep() between polls */
+void
+poll_wait(useconds_t usec) {
+  long long slept = now_us();
+  usleep(usec); /* cut short by either signal */
+  if (bulk_active) {
+    long long t0 = now_ms();
+    bulk_deferrals++;
+    while (bulk_active && (now_ms() - t0 < BULK_DEFER_MAX_MS))
+      usleep(50*1000);
+    bulk_deferred_ms += now_ms() - t0;
+  }
+  lat.sleep_us += now_us() - slept;
+}
+
+/*
+ * What a device is known by in the journal and state file names: its serial
+ * number, or its HID path if it hasn't got one, with anything that wouldn't
+ * be safe in a file name made '_'. "-" if there's neither.
+ */
+void
+serial_key(char *key, size_t len, const wchar_t *wstr, const char *path) {
+  char *p;
+
+  if (wstr && wstr[0])
+    snprintf(key, len, "%.63ls", wstr);
+  else if (path && path[0])
+    snprintf(key, len, "%.63s", path);
+  else
+    snprintf(key, len, "-");
+  for (p = key; *p; p++)
+    if ( !((*p >= 'a') && (*p <= 'z')) && !((*p >= 'A') && (*p <= 'Z')) &&
+         !((*p >= '0') && (*p <= '9')) && (*p != '.') && (*p != '-') )
+      *p = '_';
+}
+
+/*
+ * path is what devh was opened with, or NULL for hid_open(), which picks the
+ * first one hid_enumerate() finds.
+ */
+void
+device_opened(hid_device *devh, const char *path) {
+  wchar_t wstr[64];
+  int res = hid_get_serial_number_string(devh, wstr,
+                                         sizeof(wstr)/sizeof(wstr[0]));
+  if ( (res == 0) && wstr[0] )
+    serial_key(device_serial, sizeof(device_serial), wstr, NULL);
+  else if (path)
+    serial_key(device_serial, sizeof(device_serial), NULL, path);
+  else {
+    struct hid_device_info *devs =
+      hid_enumerate(ZWO_USB_VENDOR_ID, ZWO_USB_PRODUCT_ID_EAF);
+    serial_key(device_serial, sizeof(device_serial), NULL,
+               devs ? devs->path : NULL);
+    hid_free_enumeration(devs);
+  }
+
+  path = getenv("ZWO_JOURNAL");
+  if (!path || !*path)
+    return;
+  journal = fopen(path, "a");
+  if (!journal)
+    fprintf(stderr, "unable to open journal %s\n", path);
+}
+
+void
+journal_report(const char *dir, const uint8_t *buf, int len) {
+  if (!journal)
+    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  fprintf(journal, "%ld.%06ld eaf %s %s ",
+          (long)ts.tv_sec, ts.tv_nsec / 1000, device_serial, dir);
+  for (int i = 0; i < len; i++)
+    fprintf(journal, "%02x", buf[i]);
+  fprintf(journal, "\n");
+  fflush(journal);
+}
+
 int
 eaf_set_position(hid_device *devh, uint16_t pos) {
   uint8_t buf[ZWO_REPORT_LEN];
@@ -123,9 +655,13 @@ eaf_set_position(hid_device *devh, uint16_t pos) {
   buf[13] = 0x02;
   buf[14] = 0xea;
   buf[15] = 0x60;
+  journal_report("out", buf, ZWO_REPORT_LEN);
+  long long t0 = now_us();
   int res = hid_send_feature_report(devh, buf, ZWO_REPORT_LEN);
+  latency_usb(t0);
   if (res != ZWO_REPORT_LEN)
     return -1;
+  latency_command();
 
   /* no response report for this */
   return 0;
@@ -145,6 +681,8 @@ eaf_get_position(hid_device *devh, uint16_t *posret, uint16_t *posmaxret) {
   buf[i++] = 0x5a;
   buf[i++] = 0x02;
   buf[i++] = 0x03;
+  journal_report("out", buf, ZWO_REPORT_LEN);
+  long long t0 = now_us();
   int res = hid_send_feature_report(devh, buf, ZWO_REPORT_LEN);
   if (res != ZWO_REPORT_LEN)
     return -1;
@@ -152,6 +690,9 @@ eaf_get_position(hid_device *devh, uint16_t *posret, uint16_t *posmaxret) {
   memset(buf, 0, sizeof(buf));
   buf[0] = 0x01; // report ID
   res = hid_get_feature_report(devh, buf, 1+ZWO_REPORT_LEN);
+  latency_usb(t0);
+  if (res > 0)
+    journal_report("in", buf, res);
   if (res != ZWO_REPORT_LEN)
     return -1;
   /* check assumptions on the bytes seem to be constant... */
@@ -171,9 +712,11 @@ eaf_get_position(hid_device *devh, uint16_t *posret, uint16_t *posmaxret) {
   uint8_t status2 = buf[11]; /* no idea. */
   uint8_t status3 = buf[12]; /* no idea. */
   /* buf[13] is garbage from whatever was in the buffer */
-  printf("position report: status=%d, status2=0x%02x, status3=0x%02x, position=%d\n",
-         status, status2, status3, position);
+  if (verbose)
+    printf("position report: status=%d, status2=0x%02x, status3=0x%02x, position=%d\n",
+           status, status2, status3, position);
 
+  latency_position(status != 0);
   *posret = position;
   if (posmaxret)
     *posmaxret = (buf[14] << 8) | buf[15];
@@ -182,9 +725,459 @@ eaf_get_position(hid_device *devh, uint16_t *posret, uint16_t *posmaxret) {
   return 0;
 }
 
+/* for selftest: move to target and wait, giving up after about a minute */
+int
+eaf_selftest_move(hid_device *handle, uint16_t target) {
+  uint16_t pos = 0;
+  int res = -1, i;
+
+  if (eaf_set_position(handle, target) != 0)
+    return -1;
+  for (i = 0; i < 120; i++) {
+    res = eaf_get_position(handle, &pos, NULL);
+    if (res == -1) break;
+    if ( (res == 0) && (pos == target) ) return 0;
+    poll_wait(500*1000);
+  }
+  return -1;
+}
+
+/*
+ * One focuser's part of selftest, run in its own process. Prints a single
+ * line for the focuser and returns 0 if everything worked.
+ */
+int
+eaf_selftest_one(const char *path, const char *serial) {
+  long long t0 = now_ms();
+  long long t_open = 0, t_pos = 0, t_move = 0;
+  const char *what = NULL;
+  hid_device *handle = NULL;
+  uint16_t pos = 0, posmax = 0;
+  int res = -1, i;
+
+  if (hid_init() != 0) {
+    printf("%s: FAIL hid_init\n", serial);
+    return -1;
+  }
+  handle = hid_open_path(path);
+  if (!handle) {
+    what = "open";
+    goto done;
+  }
+  device_opened(handle, path);
+  t_open = now_ms();
+
+  for (i = 0; i < 120; i++) {
+    res = eaf_get_position(handle, &pos, &posmax);
+    if (res != 1) break;
+    poll_wait(500*1000);
+  }
+  if (res != 0) {
+    what = "position";
+    goto done;
+  }
+  t_pos = now_ms();
+
+  uint16_t away = (pos + SELFTEST_STEPS <= posmax) ?
+    pos + SELFTEST_STEPS : pos - SELFTEST_STEPS;
+  if ( (eaf_selftest_move(handle, away) != 0) ||
+       (eaf_selftest_move(handle, pos) != 0) ) {
+    what = "move";
+    goto done;
+  }
+  eaf_check_position(pos, NULL, NULL);
+  t_move = now_ms();
+
+done:
+  if (what)
+    printf("%s: FAIL %s after %lldms\n", serial, what, now_ms() - t0);
+  else
+    printf("%s: ok pos %d (max %d), open %lldms, position %lldms, "
+           "move %lldms\n", serial, pos, posmax, t_open - t0,
+           t_pos - t_open, t_move - t_pos);
+  if (handle)
+    hid_close(handle);
+  hid_exit();
+  return what ? -1 : 0;
+}
+
+/*
+ * Fills in paths (strdup'd) and serial_key()s for up to MAX_DEVICES
+ * focusers. Returns how many, or -1.
+ */
+int
+eaf_enumerate(char *paths[], char serials[][64]) {
+  int n = 0;
+
+  if (hid_init() != 0) {
+    fprintf(stderr, "hid_init failed\n");
+    return -1;
+  }
+  struct hid_device_info *devs, *dev;
+  devs = hid_enumerate(ZWO_USB_VENDOR_ID, ZWO_USB_PRODUCT_ID_EAF);
+  for (dev = devs; dev && (n < MAX_DEVICES); dev = dev->next) {
+    paths[n] = strdup(dev->path);
+    serial_key(serials[n], sizeof(serials[n]), dev->serial_number,
+               dev->path);
+    n++;
+  }
+  hid_free_enumeration(devs);
+  /* each child does its own init, libusb state doesn't survive fork */
+  hid_exit();
+
+  if (n == 0)
+    fprintf(stderr, "no devices found\n");
+  return n;
+}
+
+int
+eaf_selftest(void) {
+  char *paths[MAX_DEVICES];
+  char serials[MAX_DEVICES][64];
+  pid_t pids[MAX_DEVICES];
+  int n = 0, failed = 0, i;
+
+  n = eaf_enumerate(paths, serials);
+  if (n <= 0)
+    return -1;
+
+  long long t0 = now_ms();
+  fflush(stdout);
+  for (i = 0; i < n; i++) {
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      verbose = false;
+      exit(eaf_selftest_one(paths[i], serials[i]) == 0 ? 0 : 2);
+    } else if (pids[i] < 0) {
+      printf("%s: FAIL fork\n", serials[i]);
+      failed++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    int status;
+    free(paths[i]);
+    if (pids[i] < 0)
+      continue;
+    if ( (waitpid(pids[i], &status, 0) != pids[i]) ||
+         !WIFEXITED(status) || (WEXITSTATUS(status) != 0) )
+      failed++;
+  }
+  printf("%d focuser(s), %d failed, %lldms\n", n, failed, now_ms() - t0);
+  return failed ? -1 : 0;
+}
+
+/*
+ * One focuser's part of status, run in its own process. Writes what it finds
+ * to fd for the parent to print.
+ */
+void
+eaf_status_one(const char *path, const char *serial, int fd) {
+  uint16_t pos;
+  long long when;
+
+  if (hid_init() != 0) {
+    dprintf(fd, "FAIL hid_init");
+    return;
+  }
+  hid_device *handle = hid_open_path(path);
+  if (!handle) {
+    /* probably someone else has it, so go with what they last saw */
+    if (eaf_load_position(serial, &pos, &when) == 0)
+      dprintf(fd, "busy, pos %d age %lldms%s", pos, epoch_ms() - when,
+              eaf_sync_needed(serial) ? ", sync needed" : "");
+    else
+      dprintf(fd, "FAIL open");
+    hid_exit();
+    return;
+  }
+  device_opened(handle, path);
+  int res = eaf_get_position(handle, &pos, NULL);
+  if (res == 0) {
+    int offset;
+    eaf_check_position(pos, NULL, &offset);
+    if (offset)
+      dprintf(fd, "pos %d age 0ms, sync needed (reports %d)", pos + offset,
+              pos);
+    else
+      dprintf(fd, "pos %d age 0ms", pos);
+  } else if (res == 1) {
+    dprintf(fd, "moving, pos %d age 0ms", pos);
+  } else {
+    dprintf(fd, "FAIL error");
+  }
+  hid_close(handle);
+  hid_exit();
+}
+
+int
+eaf_status(long long maxage_ms) {
+  char *paths[MAX_DEVICES];
+  char serials[MAX_DEVICES][64];
+  char lines[MAX_DEVICES][128];
+  int fds[MAX_DEVICES];
+  pid_t pids[MAX_DEVICES];
+  int n, failed = 0, i;
+
+  n = eaf_enumerate(paths, serials);
+  if (n <= 0)
+    return -1;
+
+  long long now = epoch_ms();
+  fflush(stdout);
+  for (i = 0; i < n; i++) {
+    uint16_t pos;
+    long long when;
+    int p[2];
+
+    pids[i] = -1;
+    fds[i] = -1;
+    lines[i][0] = 0;
+    if ( (eaf_load_position(serials[i], &pos, &when) == 0) &&
+         (now - when <= maxage_ms) ) {
+      snprintf(lines[i], sizeof(lines[i]), "pos %d age %lldms%s",
+               pos, now - when,
+               eaf_sync_needed(serials[i]) ? ", sync needed" : "");
+      continue;
+    }
+    if (pipe(p) != 0)
+      continue;
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      close(p[0]);
+      verbose = false;
+      eaf_status_one(paths[i], serials[i], p[1]);
+      exit(0);
+    }
+    close(p[1]);
+    fds[i] = p[0];
+  }
+  for (i = 0; i < n; i++) {
+    free(paths[i]);
+    if (fds[i] != -1) {
+      ssize_t len, got = 0;
+      while ( (got < (ssize_t)sizeof(lines[i]) - 1) &&
+              ((len = read(fds[i], lines[i] + got,
+                           sizeof(lines[i]) - 1 - got)) > 0) )
+        got += len;
+      lines[i][got] = 0;
+      close(fds[i]);
+    }
+    if (pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+    if ( (lines[i][0] == 0) || (strncmp(lines[i], "FAIL", 4) == 0) )
+      failed++;
+    printf("%s: %s\n", serials[i], lines[i][0] ? lines[i] : "FAIL");
+  }
+  return failed ? -1 : 0;
+}
+
+/* what fit has worked out so far about one focuser in the journal */
+struct eaf_twin {
+  char serial[64];
+  bool have_prev;         /* previous position report */
+  double t_prev;
+  int pos_prev, status_prev;
+  int target;             /* move in progress, -1 if none */
+  double t_cmd, t_start;  /* commanded, first seen moving */
+  bool pending;           /* position request with no report back yet */
+  int moves;
+  double start_ms, move_ms;
+  double steps[0x10000 / FIT_BUCKET], secs[0x10000 / FIT_BUCKET];
+  int requests, reports, anomalies, lost;
+};
+
+/* hex string to bytes, returns how many */
+int
+parse_hex(const char *hex, uint8_t *buf, int max) {
+  int n = 0;
+  unsigned int byte;
+
+  while ( (n < max) && (sscanf(hex + n * 2, "%2x", &byte) == 1) )
+    buf[n++] = byte;
+  return n;
+}
+
+void
+eaf_fit_line(struct eaf_twin *tw, double t, const char *dir,
+             const uint8_t *buf, int len) {
+  if ( (len < ZWO_REPORT_LEN) || (buf[1] != 0x7e) || (buf[2] != 0x5a) )
+    return;
+
+  if (strcmp(dir, "out") == 0) {
+    if ( (buf[3] == 0x03) && (buf[4] == 0x01) ) {
+      tw->target = (buf[8] << 8) | buf[9];
+      tw->t_cmd = t;
+      tw->t_start = 0;
+    } else if ( (buf[3] == 0x02) && (buf[4] == 0x03) ) {
+      if (tw->pending)
+        tw->lost++;
+      tw->pending = true;
+      tw->requests++;
+    }
+    return;
+  }
+
+  if (buf[3] != 0x03)
+    return;
+  tw->pending = false;
+  tw->reports++;
+  /* same checks as eaf_get_position() */
+  if ( (buf[5] != 0x00) || (buf[6] != 0x00) || (buf[7] != 0x00) ||
+       (buf[10] != 0x00) || (buf[14] != 0xea) || (buf[15] != 0x60) )
+    tw->anomalies++;
+  int status = buf[4];
+  int pos = (buf[8] << 8) | buf[9];
+  /* whatever changed happened between the report before and this one, so
+   * take the middle rather than count the recording run's polling
+   */
+  double t_mid = t;
+  if ( (tw->target >= 0) && tw->have_prev && (tw->t_prev > tw->t_cmd) )
+    t_mid = (t + tw->t_prev) / 2;
+  else if (tw->target >= 0)
+    t_mid = (t + tw->t_cmd) / 2;
+
+  /* speed over the stretch since the last report, if it was moving */
+  if ( tw->have_prev && (status || tw->status_prev) && (t > tw->t_prev) &&
+       (t - tw->t_prev < 5) ) {
+    int mid = (pos + tw->pos_prev) / 2;
+    tw->steps[mid / FIT_BUCKET] += abs(pos - tw->pos_prev);
+    tw->secs[mid / FIT_BUCKET] += t - tw->t_prev;
+  }
+  tw->have_prev = true;
+  tw->t_prev = t;
+  tw->pos_prev = pos;
+  tw->status_prev = status;
+
+  if (tw->target < 0)
+    return;
+  if (status && !tw->t_start)
+    tw->t_start = t_mid;
+  if ( !status && (pos == tw->target) ) {
+    tw->moves++;
+    tw->start_ms += ((tw->t_start ? tw->t_start : t_mid) - tw->t_cmd) * 1000;
+    tw->move_ms += (t_mid - tw->t_cmd) * 1000;
+    tw->target = -1;
+  }
+}
+
+void
+eaf_fit_write(FILE *f, const struct eaf_twin *tw, const char *journal) {
+  unsigned int i;
+
+  fprintf(f, "# eaf %s fitted from %s\n", tw->serial, journal);
+  if (tw->moves)
+    fprintf(f, "moves %d start %.0fms total %.0fms (means)\n", tw->moves,
+            tw->start_ms / tw->moves, tw->move_ms / tw->moves);
+  fprintf(f, "# speed <from pos> <to pos> <steps/s>\n");
+  for (i = 0; i < sizeof(tw->steps)/sizeof(tw->steps[0]); i++)
+    if (tw->secs[i] > 0)
+      fprintf(f, "speed %d %d %.0f\n", i * FIT_BUCKET,
+              (i + 1) * FIT_BUCKET - 1, tw->steps[i] / tw->secs[i]);
+  fprintf(f, "reports %d anomalies %d lost %d of %d\n",
+          tw->reports, tw->anomalies, tw->lost, tw->requests);
+}
+
+int
+eaf_fit(const char *journal) {
+  struct eaf_twin *twins = calloc(MAX_DEVICES, sizeof(*twins));
+  char line[256], dev[8], serial[64], dir[4], hex[64];
+  uint8_t buf[1+ZWO_REPORT_LEN];
+  double t;
+  int n = 0, i;
+
+  FILE *f = fopen(journal, "r");
+  if (!twins || !f) {
+    fprintf(stderr, "unable to read %s\n", journal);
+    free(twins);
+    if (f)
+      fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    int got = sscanf(line, "%lf %7s %63s %3s %63s", &t, dev, serial, dir, hex);
+    if ( (got != 5) || (strcmp(dev, "eaf") != 0) )
+      continue;
+    for (i = 0; (i < n) && (strcmp(twins[i].serial, serial) != 0); i++)
+      ;
+    if (i == n) {
+      if (n == MAX_DEVICES)
+        continue;
+      snprintf(twins[n].serial, sizeof(twins[0].serial), "%s", serial);
+      twins[n++].target = -1;
+    }
+    eaf_fit_line(&twins[i], t, dir, buf, parse_hex(hex, buf, sizeof(buf)));
+  }
+  fclose(f);
+
+  int res = 0;
+  for (i = 0; i < n; i++) {
+    char path[512], name[128];
+    eaf_fit_write(stdout, &twins[i], journal);
+    snprintf(name, sizeof(name), "eaf-%s.twin", twins[i].serial);
+    FILE *out = NULL;
+    if (state_path(path, sizeof(path), name) == 0)
+      out = fopen(path, "w");
+    if (!out) {
+      fprintf(stderr, "unable to write profile for %s\n", twins[i].serial);
+      res = -1;
+      continue;
+    }
+    eaf_fit_write(out, &twins[i], journal);
+    if (fclose(out) != 0)
+      res = -1;
+  }
+  free(twins);
+  if (n == 0)
+    fprintf(stderr, "no focusers in %s\n", journal);
+  return (n && !res) ? 0 : -1;
+}
+
 int
 main(int argc, char* argv[]) {
 
+  bulk_setup();
+
+  if ( (argc > 1) && (strcmp(argv[1], "selftest") == 0) )
+    exit(eaf_selftest() == 0 ? 0 : 2);
+  if ( (argc > 2) && (strcmp(argv[1], "fit") == 0) )
+    exit(eaf_fit(argv[2]) == 0 ? 0 : 2);
+  if ( (argc > 1) && (strcmp(argv[1], "status") == 0) ) {
+    long long maxage = STATUS_MAX_AGE_MS;
+    if (argc > 2) {
+      char *end;
+      maxage = strtoll(argv[2], &end, 10);
+      if ( (end == argv[2]) || (*end != 0) || (maxage < 0) ) {
+        fprintf(stderr, "invalid max age\n");
+        exit(2);
+      }
+    }
+    exit(eaf_status(maxage) == 0 ? 0 : 2);
+  }
+
+  const char *focustrain = NULL;
+  long int focusslot = 0;
+  double focustemp = 0;
+  if ( (argc > 4) && ((strcmp(argv[1], "focus-predict") == 0) ||
+                      (strcmp(argv[1], "focus-save") == 0)) ) {
+    char *end, *tempend;
+    focustrain = argv[2];
+    focusslot = strtol(argv[3], &end, 10);
+    focustemp = strtod(argv[4], &tempend);
+    /* the history is read back with %127s, so nothing longer */
+    if ( (focustrain[0] == 0) || (strlen(focustrain) > 127) ||
+         strpbrk(focustrain, " \t\n") ||
+         (end == argv[3]) || (*end != 0) ||
+         (focusslot < 0) || (focusslot >= 16) ||
+         (tempend == argv[4]) || (*tempend != 0) || !isfinite(focustemp) ) {
+      fprintf(stderr, "invalid train, slot or temperature\n");
+      goto errexitlast;
+    }
+    if (strcmp(argv[1], "focus-predict") == 0)
+      exit(eaf_focus_predict(focustrain, focusslot, focustemp) == 0 ? 0 : 2);
+    argc = 1; /* no move, just record where it is */
+  }
+
+  lat.start = now_us();
   long int targetpos = -1;
   bool targetrel = false;
   const char *targetrelsign = NULL;
@@ -214,6 +1207,8 @@ main(int argc, char* argv[]) {
     fprintf(stderr, "unable to open device\n");
     goto errexit;
   }
+  device_opened(handle, NULL);
+  lat.opened = now_us();
 
   /* this is in a loop in case it's moving when we start. */
   uint16_t pos = 0, posmax = 0;
@@ -223,41 +1218,65 @@ main(int argc, char* argv[]) {
       fprintf(stderr, "unrecoverable error, needs physical reset\n");
       goto errexit;
     } else if (res == 0) break;
-    usleep(500*1000);
+    poll_wait(500*1000);
+  }
+  lat.ready = now_us();
+  /* from here on positions are the saved ones, the focuser's plus offset */
+  uint16_t savedpos;
+  int offset;
+  if (eaf_check_position(pos, &savedpos, &offset) == 1)
+    fprintf(stderr, "focuser at %d but last saved position was %d, "
+            "power lost? keeping that, sync needed\n", pos, savedpos);
+  if (focustrain && offset) {
+    fprintf(stderr, "not saving focus position, sync needed\n");
+    goto errexit;
+  }
+  if ( focustrain &&
+       (eaf_focus_save(focustrain, focusslot, focustemp, pos) != 0) ) {
+    fprintf(stderr, "unable to save focus position\n");
+    goto errexit;
   }
-  printf("current pos = %d (max %d)\n", pos, posmax);
+  printf("current pos = %d (max %d)\n", pos + offset, posmax + offset);
 
   if (targetpos != -1) {
     if (targetrel)
-      targetpos = pos + (targetpos * (*targetrelsign == '-' ? -1 : 1));
+      targetpos = pos + offset +
+        (targetpos * (*targetrelsign == '-' ? -1 : 1));
     fprintf(stderr, "requesting target %ld\n", targetpos);
-    if ( (targetpos < 0) || (targetpos > posmax) ) {
+    long int fwtarget = targetpos - offset;
+    if ( (fwtarget < 0) || (fwtarget > posmax) ) {
       fprintf(stderr, "invalid target %ld\n", targetpos);
       goto errexit;
     }
-    if (eaf_set_position(handle, (uint16_t)targetpos) != 0)
+    if (eaf_set_position(handle, (uint16_t)fwtarget) != 0)
       goto errexit;
 
-    while (pos != targetpos) {
+    while (pos != fwtarget) {
       res = eaf_get_position(handle, &pos, NULL);
       if (res == -1) {
         fprintf(stderr, "unrecoverable error, needs physical reset\n");
         goto errexit;
       }
-      printf("current pos = %d (target %ld)\n", pos, targetpos);
-      if ( (res == 0) && (pos == targetpos) ) break;
-      usleep(500*1000);
+      printf("current pos = %d (target %ld)\n", pos + offset, targetpos);
+      if ( (res == 0) && (pos == fwtarget) ) break;
+      poll_wait(500*1000);
     }
+    latency_arrived();
+    if (eaf_save_position(pos + offset) != 0)
+      fprintf(stderr, "unable to save position\n");
   }
 
   hid_close(handle);
   hid_exit();
+  bulk_report();
+  latency_report();
   exit(0);
 
 errexit:
   if (handle)
     hid_close(handle);
   hid_exit();
+  bulk_report();
 errexitlast:
   exit(2);
 
@@ -5,7 +5,8 @@
  * Takes a slot number (1..7) as the only arg and will exit with clean status
  * if it successfully made it there. Otherwise exits with error code. The
  * intention is that you'd only call this and check the error code; stdout is
- * useless and stderr only useful for debugging.
+ * useless and stderr only useful for debugging, although after a move it ends
+ * with a breakdown of where the time went (see latency_report()).
  *
  * Linux:
  *   gcc -o zwoefw-set zwoefw-set.c -lhidapi-libusb -Wall -Werror
@@ -18,6 +19,56 @@
  *   ./zwoefw-set [<slot num>]; echo $?
  * Moves to slot 1 if no arg given. May need sudo on Linux.
  *
+ *   ./zwoefw-set wait [<slot num>]; echo $?
+ * Moves to the slot the same way, but first waits up to READY_TIMEOUT_MS for
+ * the wheel to show up and finish its power-on spin (reported as
+ * "calibrating"), instead of failing if it's not there or not answering yet.
+ * Reports on stderr how long that took and when the first move finished, so
+ * can be started just before plugging it in to time it.
+ *
+ *   ./zwoefw-set selftest; echo $?
+ * Finds every EFW and, on all of them at once, reads info and position and
+ * steps one slot forward as a verification move (the wheel is left there).
+ * Prints one line per wheel with timings; exits nonzero if any wheel failed.
+ *
+ *   ./zwoefw-set resume; echo $?
+ * For restarting or upgrading whatever drives the wheel without aborting a
+ * move. A move in progress is recorded (see efw_save_move()) until it's done,
+ * and SIGTERM makes a run stop after the step it's on, exiting 3, rather
+ * than part way through one. resume asks any run still going to do that,
+ * waits for it to let go of the wheel, then finishes the recorded move. If
+ * there's nothing to resume, or the run that recorded it died part way
+ * (that move isn't resumed), it just exits cleanly.
+ *
+ *   ./zwoefw-set status [<max age ms>]; echo $?
+ * One line per wheel with its slot and how old that is. Every run keeps the
+ * last stable slot it saw in the state directory (see state_path()), and
+ * that's used if it's no older than max age (default STATUS_MAX_AGE_MS);
+ * the rest of the wheels are asked all at once, one process each. A wheel
+ * another run is busy with is reported from the cache whatever its age.
+ *
+ *   ./zwoefw-set calibrate; echo $?
+ * Works out how fast the wheel can be polled while moving (see poll_usec
+ * below) by stepping it round a full turn at each of calibrate_rates, and
+ * saves the fastest rate that didn't slow it down or upset it. Later runs on
+ * the same wheel and firmware use that rate. Takes a couple of minutes.
+ *
+ *   ./zwoefw-set fit <journal>; echo $?
+ * Reads a ZWO_JOURNAL file (see journal_report()) and writes a profile of
+ * each wheel in it to efw-<serial>.twin in the state directory: step times
+ * for each slot pair seen, and how often reports were errors, looked odd or
+ * never came back. Something pretending to be that wheel can be driven from
+ * it. Prints the same on stdout.
+ *
+ *   ./zwoefw-set bench; echo $?
+ *   ./zwoefw-set raw <hex byte>...; echo $?
+ * For working out the rest of the protocol (there's surely more to set than
+ * the slot, e.g. speed or how long it spends fine aligning). raw sends
+ * 7e 5a followed by the given bytes, e.g. "raw 02 04" is the info request,
+ * and prints the response for 02 (get) commands, so commands seen in usbmon
+ * captures of the official SDK can be replayed. bench times each step of a
+ * full turn, for comparing settings changed with raw.
+ *
  * Only tested with my one 7-slot device, obviously needs some work for other
  * variants and possibly other copies of the same variant.
  *
@@ -68,10 +119,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <wchar.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <hidapi/hidapi.h>
 
@@ -81,6 +140,21 @@
 /* for requesting feature reports, add one to this and include report ID */
 #define ZWO_REPORT_LEN 16
 
+/* how many wheels selftest and status will look at */
+#define MAX_DEVICES 16
+
+/* how stale a cached slot status will report by default */
+#define STATUS_MAX_AGE_MS 1000
+
+/* longest a camera transfer can hold polling off for, see poll_wait() */
+#define BULK_DEFER_MAX_MS 10000
+
+/* how long "wait" gives the wheel to appear and get ready */
+#define READY_TIMEOUT_MS 60000
+
+/* give up on a single slot step after this long */
+#define STEP_TIMEOUT_USEC (50*1000*1000)
+
 /*
    bmRequestType 0xa1 = get report
    bmRequestType 0x21 = set report
@@ -102,8 +176,477 @@
      first two data bytes must be [0x7e, 0x5a] "~Z"
  */
 
+/*
+ * If ZWO_JOURNAL is set in the environment, every report sent to or received
+ * from the device is appended there, one per line, as
+ *   <epoch secs.usecs> efw <serial> out|in <hex bytes>
+ * so move timing and status sequences can be studied later (or replayed into
+ * something pretending to be this particular device). Both programs can share
+ * the same file.
+ */
+static FILE *journal = NULL;
+
+/* filled in by device_opened(), names per-device state files too */
+static char device_serial[64] = "-";
+
+/* position reports are printed unless this is cleared (selftest does) */
+static bool verbose = true;
+
+/* bumped whenever a report doesn't look like we expect */
+static int report_anomalies = 0;
+
+/*
+ * How long to sleep between polls in the wait loops. 500ms was always used
+ * originally; it's not known whether polling faster slows the wheel down or
+ * has something to do with the controller timeout in the FIXME above, so
+ * faster rates are only used once calibrate has tried them on that wheel.
+ */
+static useconds_t poll_usec = 500*1000;
+
+/* poll intervals calibrate tries, the original rate first */
+static const useconds_t calibrate_rates[] = {
+  500*1000, 250*1000, 100*1000, 50*1000, 20*1000,
+};
+
+long long
+now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* for timestamps that mean something to other processes */
+long long
+epoch_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long
+now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Where the time went, printed on stderr after a move by latency_report().
+ * Each step is split up by the position reports seen after the command:
+ * "command" until the first one showing it moving, "travel" until the first
+ * one with all three slot bytes on the target while still moving, which is
+ * taken to be fine alignment, "align" until the last one showing it moving,
+ * and "last poll" from there to the one showing it arrived. It got there
+ * somewhere in that last bit, so on average half of it is lost to the poll
+ * interval. If it never reports that, it's all travel.
+ */
+static struct {
+  long long start, opened, info, ready;       /* startup milestones */
+  long long cmd, first_moving, first_align, last_moving; /* current step */
+  uint8_t target;
+  long long command_us, travel_us, align_us, lastpoll_us;
+  long long usb_us, sleep_us;
+  int usb_count, steps;
+} lat;
+
+void
+latency_command(uint8_t target) {
+  lat.cmd = now_us();
+  lat.first_moving = lat.first_align = lat.last_moving = 0;
+  lat.target = target;
+}
+
+/* after every position report, with its status and three slot bytes */
+void
+latency_position(bool moving, uint8_t status, const uint8_t *slots) {
+  if (!lat.cmd || !moving)
+    return;
+  lat.last_moving = now_us();
+  if (!lat.first_moving)
+    lat.first_moving = lat.last_moving;
+  if ( !lat.first_align && (status == 4) && (slots[0] == lat.target) &&
+       (slots[1] == lat.target) && (slots[2] == lat.target) )
+    lat.first_align = lat.last_moving;
+}
+
+/* once the caller's happy the step is done */
+void
+latency_arrived(void) {
+  if (!lat.cmd)
+    return;
+  long long now = now_us();
+  long long first = lat.first_moving ? lat.first_moving : now;
+  long long last = lat.last_moving ? lat.last_moving : now;
+  long long align = lat.first_align ? lat.first_align : last;
+  lat.command_us += first - lat.cmd;
+  lat.travel_us += align - first;
+  lat.align_us += last - align;
+  lat.lastpoll_us += now - last;
+  lat.steps++;
+  lat.cmd = 0;
+}
+
+/* after each exchange with the wheel, t0 being when it started */
+void
+latency_usb(long long t0) {
+  lat.usb_us += now_us() - t0;
+  lat.usb_count++;
+}
+
+void
+latency_report(void) {
+  if (!lat.steps)
+    return;
+  long long steps_us = lat.command_us + lat.travel_us + lat.align_us +
+    lat.lastpoll_us;
+  fprintf(stderr, "latency: total %lldms, startup %lldms (open %lldms, "
+          "info %lldms, ready %lldms), %d step(s) %lldms\n",
+          (now_us() - lat.start) / 1000, (lat.ready - lat.start) / 1000,
+          (lat.opened - lat.start) / 1000, (lat.info - lat.opened) / 1000,
+          (lat.ready - lat.info) / 1000, lat.steps, steps_us / 1000);
+  fprintf(stderr, "latency: steps: command %lldms, travel %lldms, "
+          "align %lldms, last poll %lldms (about half lost to %ums polling)\n",
+          lat.command_us / 1000, lat.travel_us / 1000, lat.align_us / 1000,
+          lat.lastpoll_us / 1000, poll_usec / 1000);
+  fprintf(stderr, "latency: %d usb exchange(s) %.1fms, "
+          "%lldms asleep between polls\n",
+          lat.usb_count, lat.usb_us / 1000.0, lat.sleep_us / 1000);
+}
+
+/*
+ * Capture software can send SIGUSR1 while it's pulling a frame off a camera
+ * on the same USB controller, and SIGUSR2 when it's done, e.g.
+ *   pkill -USR1 -x 'zwoefw-set|zwoeaf-set'; <download>;
+ *   pkill -USR2 -x 'zwoefw-set|zwoeaf-set'
+ * Match the names exactly: anything else that gets these signals without a
+ * handler for them is killed by them.
+ * Polls due in between are held off until SIGUSR2 (or BULK_DEFER_MAX_MS)
+ * and then done straight away. How much that delayed things is printed on
+ * stderr at exit.
+ */
+static volatile sig_atomic_t bulk_active = 0;
+static int bulk_deferrals = 0;
+static long long bulk_deferred_ms = 0;
+
+void
+bulk_signal(int sig) {
+  bulk_active = (sig == SIGUSR1);
+}
+
+void
+bulk_setup(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = bulk_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+void
+bulk_report(void) {
+  if (bulk_deferrals)
+    fprintf(stderr, "held off %d poll(s) for %lldms during camera transfers\n",
+            bulk_deferrals, bulk_deferred_ms);
+}
+
+/* use instead of usleep() between polls */
+void
+poll_wait(useconds_t usec) {
+  long long slept = now_us();
+  usleep(usec); /* cut short by either signal */
+  if (bulk_active) {
+    long long t0 = now_ms();
+    bulk_deferrals++;
+    while (bulk_active && (now_ms() - t0 < BULK_DEFER_MAX_MS))
+      usleep(50*1000);
+    bulk_deferred_ms += now_ms() - t0;
+  }
+  lat.sleep_us += now_us() - slept;
+}
+
+/*
+ * What a device is known by in the journal and state file names: its serial
+ * number, or its HID path if it hasn't got one, with anything that wouldn't
+ * be safe in a file name made '_'. "-" if there's neither.
+ */
+void
+serial_key(char *key, size_t len, const wchar_t *wstr, const char *path) {
+  char *p;
+
+  if (wstr && wstr[0])
+    snprintf(key, len, "%.63ls", wstr);
+  else if (path && path[0])
+    snprintf(key, len, "%.63s", path);
+  else
+    snprintf(key, len, "-");
+  for (p = key; *p; p++)
+    if ( !((*p >= 'a') && (*p <= 'z')) && !((*p >= 'A') && (*p <= 'Z')) &&
+         !((*p >= '0') && (*p <= '9')) && (*p != '.') && (*p != '-') )
+      *p = '_';
+}
+
+/*
+ * path is what devh was opened with, or NULL for hid_open(), which picks the
+ * first one hid_enumerate() finds.
+ */
+void
+device_opened(hid_device *devh, const char *path) {
+  wchar_t wstr[64];
+  int res = hid_get_serial_number_string(devh, wstr,
+                                         sizeof(wstr)/sizeof(wstr[0]));
+  if ( (res == 0) && wstr[0] )
+    serial_key(device_serial, sizeof(device_serial), wstr, NULL);
+  else if (path)
+    serial_key(device_serial, sizeof(device_serial), NULL, path);
+  else {
+    struct hid_device_info *devs =
+      hid_enumerate(ZWO_USB_VENDOR_ID, ZWO_USB_PRODUCT_ID_EFW);
+    serial_key(device_serial, sizeof(device_serial), NULL,
+               devs ? devs->path : NULL);
+    hid_free_enumeration(devs);
+  }
+
+  path = getenv("ZWO_JOURNAL");
+  if (!path || !*path)
+    return;
+  journal = fopen(path, "a");
+  if (!journal)
+    fprintf(stderr, "unable to open journal %s\n", path);
+}
+
+void
+journal_report(const char *dir, const uint8_t *buf, int len) {
+  if (!journal)
+    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  fprintf(journal, "%ld.%06ld efw %s %s ",
+          (long)ts.tv_sec, ts.tv_nsec / 1000, device_serial, dir);
+  for (int i = 0; i < len; i++)
+    fprintf(journal, "%02x", buf[i]);
+  fprintf(journal, "\n");
+  fflush(journal);
+}
+
+/*
+ * Per-device state lives in $ZWO_STATE_DIR, or ~/.zwo if that isn't set.
+ * Fills in the path to the named file, creating the directory if needed.
+ */
+int
+state_path(char *path, size_t len, const char *name) {
+  char dirbuf[256];
+  const char *dir = getenv("ZWO_STATE_DIR");
+  if (!dir || !*dir) {
+    const char *home = getenv("HOME");
+    if (!home)
+      return -1;
+    snprintf(dirbuf, sizeof(dirbuf), "%s/.zwo", home);
+    dir = dirbuf;
+  }
+  mkdir(dir, 0755); /* fine if it's already there */
+  if (snprintf(path, len, "%s/%s", dir, name) >= (int)len)
+    return -1;
+  return 0;
+}
+
+/* use the calibrated poll rate for this wheel, if there is one */
+void
+efw_load_poll(const char *fw) {
+  char path[512], name[128], savedfw[32];
+  unsigned long usec;
+  unsigned int r;
+
+  snprintf(name, sizeof(name), "efw-%s.poll", device_serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  /* only something calibrate could have saved, anything else is ignored */
+  if ( (fscanf(f, "%31s %lu", savedfw, &usec) == 2) &&
+       (strcmp(savedfw, fw) == 0) ) {
+    for (r = 0; r < sizeof(calibrate_rates)/sizeof(calibrate_rates[0]); r++)
+      if (usec == calibrate_rates[r])
+        poll_usec = usec;
+  }
+  fclose(f);
+}
+
+int
+efw_save_poll(const char *fw) {
+  char path[512], name[128];
+
+  snprintf(name, sizeof(name), "efw-%s.poll", device_serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return -1;
+  fprintf(f, "%s %lu\n", fw, (unsigned long)poll_usec);
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Last stable slot seen, as "<slot> <epoch ms>", kept for status. Written to
+ * a temporary and renamed over so status never reads half of it.
+ */
+void
+efw_save_slot(uint8_t slot) {
+  char path[512], tmppath[520], name[128];
+
+  snprintf(name, sizeof(name), "efw-%s.slot", device_serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return;
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+  FILE *f = fopen(tmppath, "w");
+  if (!f)
+    return;
+  fprintf(f, "%d %lld\n", slot, epoch_ms());
+  if (fclose(f) == 0)
+    rename(tmppath, path);
+}
+
+int
+efw_load_slot(const char *serial, uint8_t *slotret, long long *whenret) {
+  char path[512], name[128];
+  int slot;
+
+  snprintf(name, sizeof(name), "efw-%s.slot", serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  int n = fscanf(f, "%d %lld", &slot, whenret);
+  fclose(f);
+  if ( (n != 2) || (slot < 1) || (slot > 7) )
+    return -1;
+  *slotret = slot;
+  return 0;
+}
+
+/*
+ * The move in progress, if any, as "<target slot> <pid>", so a later run can
+ * take over; see resume above. The run doing the move holds a lock on the
+ * file for as long as it's moving, so the pid can be checked against the lock
+ * holder and a record left behind by a run that died isn't mistaken for one
+ * still going. A run stopped to be resumed rewrites the pid as 0.
+ */
+static int move_fd = -1;
+
+int
+efw_write_move(uint8_t target, pid_t pid) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%d %ld\n", target, (long)pid);
+  if ( (ftruncate(move_fd, 0) != 0) ||
+       (pwrite(move_fd, buf, len, 0) != len) )
+    return -1;
+  return 0;
+}
+
+/*
+ * Returns 1 if another run has the move locked, -1 if it couldn't be
+ * recorded for any other reason (the move can still go ahead, it just can't
+ * be handed over).
+ */
+int
+efw_save_move(uint8_t target) {
+  char path[512], name[128];
+  struct flock fl;
+
+  snprintf(name, sizeof(name), "efw-%s.move", device_serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return -1;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  if (fcntl(fd, F_SETLK, &fl) != 0) {
+    int busy = (errno == EAGAIN) || (errno == EACCES);
+    close(fd);
+    return busy ? 1 : -1;
+  }
+  move_fd = fd;
+  return efw_write_move(target, getpid());
+}
+
+int
+efw_load_move(const char *serial, uint8_t *targetret, pid_t *pidret) {
+  char path[512], name[128];
+  int target;
+  long pid;
+
+  snprintf(name, sizeof(name), "efw-%s.move", serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  int n = fscanf(f, "%d %ld", &target, &pid);
+  fclose(f);
+  if ( (n != 2) || (target < 1) || (target > 7) )
+    return -1;
+  *targetret = target;
+  *pidret = pid;
+  return 0;
+}
+
+/* pid of the run with the move locked, 0 if none, -1 if unable to tell */
+pid_t
+efw_move_holder(const char *serial) {
+  char path[512], name[128];
+  struct flock fl;
+
+  snprintf(name, sizeof(name), "efw-%s.move", serial);
+  if (state_path(path, sizeof(path), name) != 0)
+    return -1;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  int res = fcntl(fd, F_GETLK, &fl);
+  close(fd);
+  if (res != 0)
+    return -1;
+  return fl.l_type == F_UNLCK ? 0 : fl.l_pid;
+}
+
+/* stopped part way, leave the move for resume */
+void
+efw_leave_move(uint8_t target) {
+  if (move_fd == -1)
+    return;
+  efw_write_move(target, 0);
+  close(move_fd);
+  move_fd = -1;
+}
+
+/* only the run that recorded the move gets rid of it */
+void
+efw_clear_move(void) {
+  char path[512], name[128];
+
+  if (move_fd == -1)
+    return;
+  snprintf(name, sizeof(name), "efw-%s.move", device_serial);
+  if (state_path(path, sizeof(path), name) == 0)
+    unlink(path);
+  close(move_fd);
+  move_fd = -1;
+}
+
+/*
+ * fwret gets bytes 4..7 of the info report in hex, which look like a
+ * firmware version (03000900 on mine) but that's a guess.
+ */
 int
-efw_get_info(hid_device *devh) {
+efw_get_info(hid_device *devh, char *fwret, size_t fwlen) {
   uint8_t buf[1+ZWO_REPORT_LEN];
 
   memset(buf, 0, sizeof(buf));
@@ -113,6 +656,8 @@ efw_get_info(hid_device *devh) {
   buf[i++] = 0x5a;
   buf[i++] = 0x02;
   buf[i++] = 0x04;
+  journal_report("out", buf, ZWO_REPORT_LEN);
+  long long t0 = now_us();
   int res = hid_send_feature_report(devh, buf, ZWO_REPORT_LEN);
   if (res != ZWO_REPORT_LEN)
     return -1;
@@ -121,6 +666,9 @@ efw_get_info(hid_device *devh) {
   buf[0] = 0x01; // report ID
   /* if you request more than ZWO_REPORT_LEN it will send gibberish... */
   res = hid_get_feature_report(devh, buf, 1+ZWO_REPORT_LEN);
+  latency_usb(t0);
+  if (res > 0)
+    journal_report("in", buf, res);
   if (res != ZWO_REPORT_LEN)
     return -1;
 
@@ -128,7 +676,10 @@ efw_get_info(hid_device *devh) {
     0x01, 0x7e, 0x5a, 0x04, 0x03, 0x00, 0x09, 0x00,
     0x45, 0x46, 0x57, 0x2d, 0x53, 0x2d, 0x30, 0x00,
   };
+  if (fwret)
+    snprintf(fwret, fwlen, "%02x%02x%02x%02x", buf[4], buf[5], buf[6], buf[7]);
   if (memcmp(expected, buf, ZWO_REPORT_LEN) != 0) {
+    report_anomalies++;
     fprintf(stderr, "unexpected values in info report: ");
     for (i = 0; i < ZWO_REPORT_LEN; i++)
       fprintf(stderr, " %02x", buf[i]);
@@ -152,14 +703,39 @@ efw_set_position(hid_device *devh, uint8_t slot) {
   buf[i++] = 0x01;
   buf[i++] = 0x02;
   buf[i++] = slot; /* first filter is 1 not 0 */
+  journal_report("out", buf, ZWO_REPORT_LEN);
+  long long t0 = now_us();
   int res = hid_send_feature_report(devh, buf, ZWO_REPORT_LEN);
+  latency_usb(t0);
   if (res != ZWO_REPORT_LEN)
     return -1;
+  latency_command(slot);
 
   /* no response report for this */
   return 0;
 }
 
+/*
+ * Set while "wait" waits for the wheel to be ready. Nothing has told it to
+ * move since it was opened, so if it's moving it's the power-on spin.
+ */
+static bool awaiting_ready = false;
+
+/*
+ * Position report status byte, as far as I've seen. The spin after power-on
+ * or reset hasn't been captured yet, so if it has its own status it'll show
+ * up as unknown here (and in the journal) until it is.
+ */
+const char *
+efw_status_name(uint8_t status) {
+  switch (status) {
+  case 1: return "stable";
+  case 4: return "moving";
+  case 6: return "error";
+  }
+  return "unknown";
+}
+
 int
 efw_get_position(hid_device *devh, uint8_t *slotret) {
   uint8_t buf[1+ZWO_REPORT_LEN];
@@ -174,6 +750,8 @@ efw_get_position(hid_device *devh, uint8_t *slotret) {
   buf[i++] = 0x5a;
   buf[i++] = 0x02;
   buf[i++] = 0x01;
+  journal_report("out", buf, ZWO_REPORT_LEN);
+  long long t0 = now_us();
   int res = hid_send_feature_report(devh, buf, ZWO_REPORT_LEN);
   if (res != ZWO_REPORT_LEN)
     return -1;
@@ -192,6 +770,9 @@ efw_get_position(hid_device *devh, uint8_t *slotret) {
   memset(buf, 0, sizeof(buf));
   buf[0] = 0x01; // report ID
   res = hid_get_feature_report(devh, buf, 1+ZWO_REPORT_LEN);
+  latency_usb(t0);
+  if (res > 0)
+    journal_report("in", buf, res);
   if (res != ZWO_REPORT_LEN)
     return -1;
   /* check assumptions on the bytes seem to be constant... */
@@ -201,21 +782,28 @@ efw_get_position(hid_device *devh, uint8_t *slotret) {
        (buf[10] != 0x00) || (buf[11] != 0x00) ||
        (buf[12] != 0x00) || (buf[13] != 0x00) ||
        (buf[14] != 0x30) || (buf[15] != 0x00) ) {
+    report_anomalies++;
     fprintf(stderr, "unexpected values in position report: ");
     for (i = 0; i < ZWO_REPORT_LEN; i++)
       fprintf(stderr, " %02x", buf[i]);
     fprintf(stderr, "\n");
   }
-  uint8_t status = buf[4]; /* 4=moving, 1=stable ? */
+  uint8_t status = buf[4]; /* see efw_status_name() */
   uint8_t errcode = buf[5];
   /* just guessing on these... */
   uint8_t slot_current = buf[6];
   uint8_t slot_max = buf[9];
-  printf("position report: status=%d, [%d, %d, %d], max=%d\n",
-         status, buf[6], buf[7], buf[8], slot_max);
+  if (verbose)
+    printf("position report: status=%d (%s), [%d, %d, %d], max=%d\n",
+           status, (awaiting_ready && (status == 4)) ?
+           "calibrating" : efw_status_name(status),
+           buf[6], buf[7], buf[8], slot_max);
 
-  if ( (buf[6] == buf[7]) && (buf[7] == buf[8]) && (status == 1) ) {
+  bool stable = (buf[6] == buf[7]) && (buf[7] == buf[8]) && (status == 1);
+  latency_position(!stable, status, buf + 6);
+  if (stable) {
     *slotret = slot_current;
+    efw_save_slot(slot_current);
     return 0;
   }
   if ( (status == 6) || (errcode != 0) ) {
@@ -225,11 +813,648 @@ efw_get_position(hid_device *devh, uint8_t *slotret) {
   return 1; /* caller should wait it out */
 }
 
+/*
+ * Send 7e 5a followed by cmd. Commands starting 02 seem to be gets and have a
+ * response report, which is printed; anything else is sent blind like set
+ * position.
+ */
+int
+efw_raw(hid_device *devh, const uint8_t *cmd, int len) {
+  uint8_t buf[1+ZWO_REPORT_LEN];
+
+  if ( (len < 1) || (len > ZWO_REPORT_LEN - 3) )
+    return -1;
+
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 0x03; // report ID
+  buf[1] = 0x7e;
+  buf[2] = 0x5a;
+  memcpy(buf + 3, cmd, len);
+  journal_report("out", buf, ZWO_REPORT_LEN);
+  int res = hid_send_feature_report(devh, buf, ZWO_REPORT_LEN);
+  if (res != ZWO_REPORT_LEN)
+    return -1;
+  if (cmd[0] != 0x02)
+    return 0;
+
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 0x01; // report ID
+  res = hid_get_feature_report(devh, buf, 1+ZWO_REPORT_LEN);
+  if (res > 0)
+    journal_report("in", buf, res);
+  if (res != ZWO_REPORT_LEN)
+    return -1;
+  printf("response:");
+  for (int i = 0; i < ZWO_REPORT_LEN; i++)
+    printf(" %02x", buf[i]);
+  printf("\n");
+  return 0;
+}
+
+/* set by SIGTERM, checked between steps of a move */
+static volatile sig_atomic_t stop_requested = 0;
+
+void
+stop_signal(int sig) {
+  stop_requested = 1;
+}
+
+/*
+ * Wait until the wheel will take a command: answering, stable, and all
+ * three slot fields agreeing. Returns 0 with *slot set. With no deadline
+ * (0) any error is fatal; otherwise errors are taken to mean it's still
+ * starting up and it keeps trying until now_ms() passes the deadline.
+ */
+int
+efw_wait_ready(hid_device *devh, uint8_t *slot, long long deadline) {
+  int res;
+
+  awaiting_ready = (deadline != 0);
+  for (;;) {
+    res = efw_get_position(devh, slot);
+    if (res == 0)
+      break;
+    if ( (res == -1) && !deadline )
+      break;
+    if (deadline && (now_ms() > deadline)) {
+      res = -1;
+      break;
+    }
+    poll_wait(poll_usec);
+  }
+  awaiting_ready = false;
+  return res;
+}
+
+/*
+ * Step forward one slot from *slot and wait for the wheel to get there.
+ * Returns 0 with *slot updated, 1 if it hadn't arrived by STEP_TIMEOUT_USEC
+ * (*slot is wherever it last reported being stable), or -1 if it errored.
+ */
+int
+efw_step(hid_device *devh, uint8_t *slot) {
+  uint8_t nextslot = ((*slot - 1 + 1) % 7) + 1;
+  int res, i;
+
+  if (efw_set_position(devh, nextslot) != 0)
+    return -1;
+  for (i = 0; i < STEP_TIMEOUT_USEC / poll_usec; i++) {
+    res = efw_get_position(devh, slot);
+    /* it takes a moment for it to process the slot change, so only stop
+     * polling if we've made it even if not currently moving.
+     */
+    if (res == -1)
+      return -1;
+    if ( (res == 0) && (*slot == nextslot) ) {
+      latency_arrived();
+      return 0;
+    }
+    poll_wait(poll_usec);
+  }
+  return 1;
+}
+
+/*
+ * Time each step of a full turn. This only ever goes forward, so the pairs
+ * timed are each slot and the next one.
+ */
+int
+efw_bench(hid_device *devh, uint8_t *slot) {
+  long long total = 0;
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    uint8_t from = *slot;
+    long long t0 = now_ms();
+    if (efw_step(devh, slot) != 0)
+      return -1;
+    long long t = now_ms() - t0;
+    total += t;
+    printf("bench %d->%d: %lldms\n", from, *slot, t);
+  }
+  printf("bench total: %lldms (poll %ums)\n", total, poll_usec / 1000);
+  return 0;
+}
+
+/*
+ * Step a full turn at each of calibrate_rates, slowest first, and keep the
+ * fastest one where the steps took no longer than at the original rate and no
+ * odd reports turned up. Each measured step includes on average half a poll
+ * interval of waiting after arrival, so that's taken off before comparing.
+ * A step failing is most likely the wheel wedging at that rate, and it'll
+ * need a reset before anything else, so that stops it there and fails, but
+ * the last rate that passed is still saved so a rerun doesn't wedge it again.
+ */
+int
+efw_calibrate(hid_device *devh, uint8_t *slot, const char *fw) {
+  useconds_t best = calibrate_rates[0];
+  long long baseline = 0;
+  unsigned int r;
+  int i;
+
+  for (r = 0; r < sizeof(calibrate_rates)/sizeof(calibrate_rates[0]); r++) {
+    poll_usec = calibrate_rates[r];
+    int anomalies = report_anomalies;
+    long long t0 = now_ms();
+    for (i = 0; i < 7; i++) {
+      if (efw_step(devh, slot) != 0)
+        break;
+    }
+    if (i < 7) {
+      fprintf(stderr, "poll %ums: step failed\n", poll_usec / 1000);
+      poll_usec = best;
+      if (r > 0) {
+        printf("poll rate for %s (firmware %s) = %ums\n",
+               device_serial, fw, poll_usec / 1000);
+        efw_save_poll(fw);
+      }
+      fprintf(stderr, "unrecoverable wheel error, needs physical reset\n");
+      return -1;
+    }
+    long long step = (now_ms() - t0) / 7 - poll_usec / 2000;
+    anomalies = report_anomalies - anomalies;
+    fprintf(stderr, "poll %ums: step %lldms, %d odd reports\n",
+            poll_usec / 1000, step, anomalies);
+    if (r == 0)
+      baseline = step;
+    else if ( (anomalies != 0) || (step > baseline + baseline / 20) )
+      break;
+    best = poll_usec;
+  }
+
+  poll_usec = best;
+  printf("poll rate for %s (firmware %s) = %ums\n",
+         device_serial, fw, poll_usec / 1000);
+  return efw_save_poll(fw);
+}
+
+/*
+ * One wheel's part of selftest, run in its own process. Prints a single line
+ * for the wheel and returns 0 if everything worked.
+ */
+int
+efw_selftest_one(const char *path, const char *serial) {
+  long long t0 = now_ms();
+  long long t_open = 0, t_info = 0, t_pos = 0, t_move = 0;
+  const char *what = NULL;
+  hid_device *handle = NULL;
+  char fw[16];
+  uint8_t slot = 0;
+  int res = -1, i;
+
+  if (hid_init() != 0) {
+    printf("%s: FAIL hid_init\n", serial);
+    return -1;
+  }
+  handle = hid_open_path(path);
+  if (!handle) {
+    what = "open";
+    goto done;
+  }
+  device_opened(handle, path);
+  t_open = now_ms();
+
+  if (efw_get_info(handle, fw, sizeof(fw)) != 0) {
+    what = "info";
+    goto done;
+  }
+  efw_load_poll(fw);
+  t_info = now_ms();
+
+  for (i = 0; i < STEP_TIMEOUT_USEC / poll_usec; i++) {
+    res = efw_get_position(handle, &slot);
+    if (res != 1) break;
+    poll_wait(poll_usec);
+  }
+  if (res != 0) {
+    what = "position";
+    goto done;
+  }
+  t_pos = now_ms();
+
+  if (efw_step(handle, &slot) != 0) {
+    what = "move";
+    goto done;
+  }
+  t_move = now_ms();
+
+done:
+  if (what)
+    printf("%s: FAIL %s after %lldms\n", serial, what, now_ms() - t0);
+  else
+    printf("%s: ok slot %d, open %lldms, info %lldms, position %lldms, "
+           "move %lldms\n", serial, slot, t_open - t0, t_info - t_open,
+           t_pos - t_info, t_move - t_pos);
+  if (handle)
+    hid_close(handle);
+  hid_exit();
+  return what ? -1 : 0;
+}
+
+/*
+ * Fills in paths (strdup'd) and serial_key()s for up to MAX_DEVICES
+ * wheels. Returns how many, or -1.
+ */
+int
+efw_enumerate(char *paths[], char serials[][64]) {
+  int n = 0;
+
+  if (hid_init() != 0) {
+    fprintf(stderr, "hid_init failed\n");
+    return -1;
+  }
+  struct hid_device_info *devs, *dev;
+  devs = hid_enumerate(ZWO_USB_VENDOR_ID, ZWO_USB_PRODUCT_ID_EFW);
+  for (dev = devs; dev && (n < MAX_DEVICES); dev = dev->next) {
+    paths[n] = strdup(dev->path);
+    serial_key(serials[n], sizeof(serials[n]), dev->serial_number,
+               dev->path);
+    n++;
+  }
+  hid_free_enumeration(devs);
+  /* each child does its own init, libusb state doesn't survive fork */
+  hid_exit();
+
+  if (n == 0)
+    fprintf(stderr, "no devices found\n");
+  return n;
+}
+
+int
+efw_selftest(void) {
+  char *paths[MAX_DEVICES];
+  char serials[MAX_DEVICES][64];
+  pid_t pids[MAX_DEVICES];
+  int n = 0, failed = 0, i;
+
+  n = efw_enumerate(paths, serials);
+  if (n <= 0)
+    return -1;
+
+  long long t0 = now_ms();
+  fflush(stdout);
+  for (i = 0; i < n; i++) {
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      verbose = false;
+      exit(efw_selftest_one(paths[i], serials[i]) == 0 ? 0 : 2);
+    } else if (pids[i] < 0) {
+      printf("%s: FAIL fork\n", serials[i]);
+      failed++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    int status;
+    free(paths[i]);
+    if (pids[i] < 0)
+      continue;
+    if ( (waitpid(pids[i], &status, 0) != pids[i]) ||
+         !WIFEXITED(status) || (WEXITSTATUS(status) != 0) )
+      failed++;
+  }
+  printf("%d wheel(s), %d failed, %lldms\n", n, failed, now_ms() - t0);
+  return failed ? -1 : 0;
+}
+
+/*
+ * One wheel's part of status, run in its own process. Writes what it finds
+ * to fd for the parent to print.
+ */
+void
+efw_status_one(const char *path, const char *serial, int fd) {
+  uint8_t slot;
+  long long when;
+
+  if (hid_init() != 0) {
+    dprintf(fd, "FAIL hid_init");
+    return;
+  }
+  hid_device *handle = hid_open_path(path);
+  if (!handle) {
+    /* probably someone else has it, so go with what they last saw */
+    if (efw_load_slot(serial, &slot, &when) == 0)
+      dprintf(fd, "busy, slot %d age %lldms", slot, epoch_ms() - when);
+    else
+      dprintf(fd, "FAIL open");
+    hid_exit();
+    return;
+  }
+  device_opened(handle, path);
+  int res = efw_get_position(handle, &slot);
+  if (res == 0)
+    dprintf(fd, "slot %d age 0ms", slot);
+  else if (res == 1)
+    dprintf(fd, "moving");
+  else
+    dprintf(fd, "FAIL error");
+  hid_close(handle);
+  hid_exit();
+}
+
+int
+efw_status(long long maxage_ms) {
+  char *paths[MAX_DEVICES];
+  char serials[MAX_DEVICES][64];
+  char lines[MAX_DEVICES][128];
+  int fds[MAX_DEVICES];
+  pid_t pids[MAX_DEVICES];
+  int n, failed = 0, i;
+
+  n = efw_enumerate(paths, serials);
+  if (n <= 0)
+    return -1;
+
+  long long now = epoch_ms();
+  fflush(stdout);
+  for (i = 0; i < n; i++) {
+    uint8_t slot;
+    long long when;
+    int p[2];
+
+    pids[i] = -1;
+    fds[i] = -1;
+    lines[i][0] = 0;
+    if ( (efw_load_slot(serials[i], &slot, &when) == 0) &&
+         (now - when <= maxage_ms) ) {
+      snprintf(lines[i], sizeof(lines[i]), "slot %d age %lldms",
+               slot, now - when);
+      continue;
+    }
+    if (pipe(p) != 0)
+      continue;
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      close(p[0]);
+      verbose = false;
+      efw_status_one(paths[i], serials[i], p[1]);
+      exit(0);
+    }
+    close(p[1]);
+    fds[i] = p[0];
+  }
+  for (i = 0; i < n; i++) {
+    free(paths[i]);
+    if (fds[i] != -1) {
+      ssize_t len, got = 0;
+      while ( (got < (ssize_t)sizeof(lines[i]) - 1) &&
+              ((len = read(fds[i], lines[i] + got,
+                           sizeof(lines[i]) - 1 - got)) > 0) )
+        got += len;
+      lines[i][got] = 0;
+      close(fds[i]);
+    }
+    if (pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+    if ( (lines[i][0] == 0) || (strncmp(lines[i], "FAIL", 4) == 0) )
+      failed++;
+    printf("%s: %s\n", serials[i], lines[i][0] ? lines[i] : "FAIL");
+  }
+  return failed ? -1 : 0;
+}
+
+/* what fit has worked out so far about one wheel in the journal */
+struct efw_twin {
+  char serial[64];
+  int last_slot;          /* last stable slot seen, 0 if none yet */
+  int from, target;       /* step in progress, target 0 if none */
+  double t_cmd, t_seen;   /* commanded, last report not there yet */
+  bool pending;           /* position request with no report back yet */
+  int n[8][8];
+  double sum[8][8], min[8][8], max[8][8];
+  int requests, reports, errors, anomalies, lost;
+};
+
+/* hex string to bytes, returns how many */
+int
+parse_hex(const char *hex, uint8_t *buf, int max) {
+  int n = 0;
+  unsigned int byte;
+
+  while ( (n < max) && (sscanf(hex + n * 2, "%2x", &byte) == 1) )
+    buf[n++] = byte;
+  return n;
+}
+
+void
+efw_fit_line(struct efw_twin *tw, double t, const char *dir,
+             const uint8_t *buf, int len) {
+  if ( (len < ZWO_REPORT_LEN) || (buf[1] != 0x7e) || (buf[2] != 0x5a) )
+    return;
+
+  if (strcmp(dir, "out") == 0) {
+    if ( (buf[3] == 0x01) && (buf[4] == 0x02) ) {
+      tw->from = tw->last_slot;
+      tw->target = buf[5];
+      tw->t_cmd = tw->t_seen = t;
+    } else if ( (buf[3] == 0x02) && (buf[4] == 0x01) ) {
+      if (tw->pending)
+        tw->lost++;
+      tw->pending = true;
+      tw->requests++;
+    }
+    return;
+  }
+
+  if (buf[3] != 0x01)
+    return; /* info or something else */
+  tw->pending = false;
+  tw->reports++;
+  /* same checks as efw_get_position() */
+  if ( (buf[10] != 0x00) || (buf[11] != 0x00) ||
+       (buf[12] != 0x00) || (buf[13] != 0x00) ||
+       (buf[14] != 0x30) || (buf[15] != 0x00) )
+    tw->anomalies++;
+  if ( (buf[4] == 6) || (buf[5] != 0) ) {
+    tw->errors++;
+    tw->target = 0;
+    return;
+  }
+  if ( (buf[6] != buf[7]) || (buf[7] != buf[8]) || (buf[4] != 1) ) {
+    tw->t_seen = t;
+    return;
+  }
+  tw->last_slot = buf[6];
+  if ( !tw->target || (buf[6] != tw->target) ) {
+    tw->t_seen = t;
+    return;
+  }
+  if ( (tw->from >= 1) && (tw->from <= 7) && (tw->target <= 7) ) {
+    int f = tw->from, to = tw->target;
+    /* it got there between the last report saying otherwise and this one,
+     * so take the middle, rather than count the recording run's polling
+     */
+    double ms = ((t + tw->t_seen) / 2 - tw->t_cmd) * 1000;
+    if ( (tw->n[f][to] == 0) || (ms < tw->min[f][to]) )
+      tw->min[f][to] = ms;
+    if ( (tw->n[f][to] == 0) || (ms > tw->max[f][to]) )
+      tw->max[f][to] = ms;
+    tw->sum[f][to] += ms;
+    tw->n[f][to]++;
+  }
+  tw->target = 0;
+}
+
+void
+efw_fit_write(FILE *f, const struct efw_twin *tw, const char *journal) {
+  int i, j;
+
+  fprintf(f, "# efw %s fitted from %s\n", tw->serial, journal);
+  fprintf(f, "# step <from> <to> <count> <mean ms> <min ms> <max ms>\n");
+  for (i = 1; i <= 7; i++)
+    for (j = 1; j <= 7; j++)
+      if (tw->n[i][j])
+        fprintf(f, "step %d %d %d %.0f %.0f %.0f\n", i, j, tw->n[i][j],
+                tw->sum[i][j] / tw->n[i][j], tw->min[i][j], tw->max[i][j]);
+  fprintf(f, "reports %d errors %d anomalies %d lost %d of %d\n",
+          tw->reports, tw->errors, tw->anomalies, tw->lost, tw->requests);
+}
+
+int
+efw_fit(const char *journal) {
+  struct efw_twin *twins = calloc(MAX_DEVICES, sizeof(*twins));
+  char line[256], dev[8], serial[64], dir[4], hex[64];
+  uint8_t buf[1+ZWO_REPORT_LEN];
+  double t;
+  int n = 0, i;
+
+  FILE *f = fopen(journal, "r");
+  if (!twins || !f) {
+    fprintf(stderr, "unable to read %s\n", journal);
+    free(twins);
+    if (f)
+      fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    int got = sscanf(line, "%lf %7s %63s %3s %63s", &t, dev, serial, dir, hex);
+    if ( (got != 5) || (strcmp(dev, "efw") != 0) )
+      continue;
+    for (i = 0; (i < n) && (strcmp(twins[i].serial, serial) != 0); i++)
+      ;
+    if (i == n) {
+      if (n == MAX_DEVICES)
+        continue;
+      snprintf(twins[n++].serial, sizeof(twins[0].serial), "%s", serial);
+    }
+    efw_fit_line(&twins[i], t, dir, buf, parse_hex(hex, buf, sizeof(buf)));
+  }
+  fclose(f);
+
+  int res = 0;
+  for (i = 0; i < n; i++) {
+    char path[512], name[128];
+    efw_fit_write(stdout, &twins[i], journal);
+    snprintf(name, sizeof(name), "efw-%s.twin", twins[i].serial);
+    FILE *out = NULL;
+    if (state_path(path, sizeof(path), name) == 0)
+      out = fopen(path, "w");
+    if (!out) {
+      fprintf(stderr, "unable to write profile for %s\n", twins[i].serial);
+      res = -1;
+      continue;
+    }
+    efw_fit_write(out, &twins[i], journal);
+    if (fclose(out) != 0)
+      res = -1;
+  }
+  free(twins);
+  if (n == 0)
+    fprintf(stderr, "no wheels in %s\n", journal);
+  return (n && !res) ? 0 : -1;
+}
+
 int
 main(int argc, char* argv[]) {
 
+  bulk_setup();
+
+  if ( (argc > 1) && (strcmp(argv[1], "selftest") == 0) )
+    exit(efw_selftest() == 0 ? 0 : 2);
+  if ( (argc > 2) && (strcmp(argv[1], "fit") == 0) )
+    exit(efw_fit(argv[2]) == 0 ? 0 : 2);
+  if ( (argc > 1) && (strcmp(argv[1], "status") == 0) ) {
+    long long maxage = STATUS_MAX_AGE_MS;
+    if (argc > 2) {
+      char *end;
+      maxage = strtoll(argv[2], &end, 10);
+      if ( (end == argv[2]) || (*end != 0) || (maxage < 0) ) {
+        fprintf(stderr, "invalid max age\n");
+        exit(2);
+      }
+    }
+    exit(efw_status(maxage) == 0 ? 0 : 2);
+  }
+
+  lat.start = now_us();
+  long long t_start = now_ms(), deadline = 0;
+  if ( (argc > 1) && (strcmp(argv[1], "wait") == 0) ) {
+    deadline = t_start + READY_TIMEOUT_MS;
+    argc--;
+    argv++;
+  }
+
+  int i;
+  bool calibrate = false, bench = false;
+  uint8_t rawcmd[ZWO_REPORT_LEN];
+  int rawlen = 0;
   uint8_t targetslot = 0;
-  if (argc > 1) {
+  if ( (argc > 1) && (strcmp(argv[1], "calibrate") == 0) ) {
+    calibrate = true;
+  } else if ( (argc > 1) && (strcmp(argv[1], "resume") == 0) ) {
+    char *paths[MAX_DEVICES];
+    char serials[MAX_DEVICES][64];
+    pid_t pid;
+
+    int n = efw_enumerate(paths, serials);
+    if (n <= 0)
+      goto errexitlast;
+    for (i = 0; i < n; i++)
+      free(paths[i]);
+    /* serials[0] is the one hid_open() will pick */
+    if (efw_load_move(serials[0], &targetslot, &pid) != 0) {
+      printf("nothing to resume\n");
+      exit(0);
+    }
+    /* only signal the pid if it's really the run with the move locked */
+    pid_t holder = efw_move_holder(serials[0]);
+    if ( (holder == -1) || ((holder != 0) && (holder != pid)) ) {
+      fprintf(stderr, "move record doesn't match its lock, not resuming\n");
+      goto errexitlast;
+    }
+    if (holder == 0) {
+      if (pid != 0) {
+        /* not locked and not stopped cleanly, whoever it was died */
+        printf("stale move to slot %d from pid %ld, not resuming\n",
+               targetslot, (long)pid);
+        exit(0);
+      }
+    } else if (kill(pid, SIGTERM) != 0) {
+      fprintf(stderr, "unable to stop pid %ld, not resuming\n", (long)pid);
+      goto errexitlast;
+    } else {
+      long long giveup = now_ms() + STEP_TIMEOUT_USEC / 1000;
+      while ( (efw_move_holder(serials[0]) == pid) && (now_ms() < giveup) )
+        usleep(10*1000);
+      if (efw_move_holder(serials[0]) != 0) {
+        fprintf(stderr, "pid %ld didn't let go of the wheel\n", (long)pid);
+        goto errexitlast;
+      }
+    }
+    printf("resuming move to slot %d\n", targetslot);
+  } else if ( (argc > 1) && (strcmp(argv[1], "bench") == 0) ) {
+    bench = true;
+  } else if ( (argc > 2) && (strcmp(argv[1], "raw") == 0) ) {
+    for (rawlen = 0; rawlen < argc - 2; rawlen++) {
+      char *end;
+      long int argint = strtol(argv[2 + rawlen], &end, 16);
+      if ( (*end != 0) || (argint < 0) || (argint > 0xff) ||
+           (rawlen >= ZWO_REPORT_LEN - 3) ) {
+        fprintf(stderr, "invalid raw command\n");
+        goto errexitlast;
+      }
+      rawcmd[rawlen] = (uint8_t)argint;
+    }
+  } else if (argc > 1) {
     long int argint = strtol(argv[1], NULL, 10);
     if ( (argint < 1) || (argint > 7) ) {
       fprintf(stderr, "invalid filter slot requested\n");
@@ -245,12 +1470,16 @@ main(int argc, char* argv[]) {
   }
 
   hid_device *handle = hid_open(ZWO_USB_VENDOR_ID, ZWO_USB_PRODUCT_ID_EFW, NULL);
+  while (!handle && deadline && (now_ms() < deadline)) {
+    usleep(100*1000);
+    handle = hid_open(ZWO_USB_VENDOR_ID, ZWO_USB_PRODUCT_ID_EFW, NULL);
+  }
   if (!handle) {
     fprintf(stderr, "unable to open device\n");
     goto errexit;
   }
-
-  int i;
+  device_opened(handle, NULL);
+  lat.opened = now_us();
 
 #ifndef __APPLE__ /* this segfaults on OS X, not interesting enough to debug */
   wchar_t wstr[255];
@@ -262,53 +1491,103 @@ main(int argc, char* argv[]) {
   printf("Product String: %ls\n", wstr);
 #endif
 
-  if (efw_get_info(handle) != 0)
-    goto errexit;
+  long long t_open = now_ms();
+  char fw[16];
+  while (efw_get_info(handle, fw, sizeof(fw)) != 0) {
+    if (!deadline || (now_ms() > deadline))
+      goto errexit;
+    usleep(100*1000);
+  }
+  efw_load_poll(fw);
+  lat.info = now_us();
+
+  if (rawlen) {
+    /* before waiting for it to settle, might be poking at a stuck wheel */
+    if (efw_raw(handle, rawcmd, rawlen) != 0)
+      goto errexit;
+    hid_close(handle);
+    hid_exit();
+    exit(0);
+  }
 
   uint8_t slot;
-  for (;;) {
-    res = efw_get_position(handle, &slot);
-    if (res == -1) {
-      fprintf(stderr, "unrecoverable wheel error, needs physical reset\n");
+  if (efw_wait_ready(handle, &slot, deadline) != 0) {
+    fprintf(stderr, "unrecoverable wheel error, needs physical reset\n");
+    goto errexit;
+  }
+  lat.ready = now_us();
+  if (deadline)
+    fprintf(stderr, "opened after %lldms, ready after %lldms\n",
+            t_open - t_start, now_ms() - t_start);
+  if (calibrate) {
+    if (efw_calibrate(handle, &slot, fw) != 0)
+      goto errexit;
+    targetslot = slot;
+  }
+  if (bench) {
+    if (efw_bench(handle, &slot) != 0)
       goto errexit;
-    } else if (res == 0) break;
-    usleep(500*1000);
+    targetslot = slot;
   }
   if (targetslot == 0)
     targetslot = slot; /* no change requested */
 
+  if (slot != targetslot) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    res = efw_save_move(targetslot);
+    if (res == 1) {
+      fprintf(stderr, "another run is moving the wheel\n");
+      goto errexit;
+    } else if (res != 0) {
+      fprintf(stderr, "unable to record move, it can't be resumed\n");
+    }
+  }
   while (slot != targetslot) {
 
-    uint8_t nextslot = ((slot - 1 + 1) % 7) + 1;
-    printf("request slot %d\n", nextslot);
-    if (efw_set_position(handle, nextslot) != 0)
-      goto errexit;
+    if (stop_requested) {
+      fprintf(stderr, "stopping at slot %d, move left to resume\n", slot);
+      hid_close(handle);
+      hid_exit();
+      /* resume takes the lock going as the wheel being free, so only now */
+      efw_leave_move(targetslot);
+      bulk_report();
+      exit(3);
+    }
 
-    for (i = 0; i < 100; i++) {
-      res = efw_get_position(handle, &slot);
-      /* it takes a moment for it to process the slot change, so only stop
-       * polling if we've made it even if not currently moving.
-       */
-      if (res == -1) {
-        fprintf(stderr, "unrecoverable wheel error, needs physical reset\n");
-        goto errexit;
-      }
-      if ( (res == 0) && (slot == nextslot) ) break;
-      usleep(500*1000);
+    printf("request slot %d\n", ((slot - 1 + 1) % 7) + 1);
+    /* not arriving in time isn't fatal, just go again from wherever it is */
+    res = efw_step(handle, &slot);
+    if (res == -1) {
+      fprintf(stderr, "unrecoverable wheel error, needs physical reset\n");
+      goto errexit;
     }
     printf("current slot = %d\n", slot);
+    if (deadline && (res == 0)) {
+      fprintf(stderr, "first move done after %lldms\n", now_ms() - t_start);
+      deadline = 0;
+    }
   }
 
   printf("final slot = %d\n", slot);
+  efw_clear_move();
 
   hid_close(handle);
   hid_exit();
+  bulk_report();
+  latency_report();
   exit(0);
 
 errexit:
+  efw_clear_move();
   if (handle)
     hid_close(handle);
   hid_exit();
+  bulk_report();
 errexitlast:
   exit(2);
 